@@ -26,7 +26,7 @@ namespace Gx {
 	using PadToAlignment = PadIfNonZero<(sizeof(T) % defaultAlignmentBytes == 0 ? 0 : defaultAlignmentBytes - sizeof(T) % defaultAlignmentBytes)>;
 
 	constexpr inline size_t alignToBits(size_t const val, size_t const alignmentBits) {
-		return (val + (1u << alignmentBits) - 1) & ~((1u << alignmentBits) - 1u);
+		return (val + (size_t(1u) << alignmentBits) - 1u) & ~((size_t(1u) << alignmentBits) - 1u);
 	}
 
 	constexpr inline size_t roundUpNearestMultiple(size_t const val, size_t const alignment) {
@@ -0,0 +1,214 @@
+#include "regionallocator"
+#include "syscall"
+
+extern "C" int __register_atfork(void (*prepare)(), void (*parent)(), void (*child)(), void *dso) __attribute__((weak));
+extern "C" int *__errno_location() __attribute__((weak));
+
+namespace Gx {
+    namespace {
+        constexpr size_t reserveSize = sizeof(size_t) == 8u ? size_t(1u) << 36u : size_t(1u) << 30u;
+        // Under ulimit -v or strict overcommit the full reservation can fail, smaller ones are tried down to this.
+        constexpr size_t minReserveSize = size_t(1u) << 24u;
+        constexpr size_t blockHeaderSize = defaultAlignmentBytes;
+        constexpr int errNoMem = 12;
+        constexpr int errInval = 22;
+
+        // Sits immediately below every pointer handed out, Bitmaps needs the length back on free.
+        struct BlockHeader {
+            size_t length;
+            size_t lead;
+        };
+        static_assert(sizeof(BlockHeader) <= blockHeaderSize, "");
+
+        SpinIncrementLock16 heapLock;
+
+        size_t strlen(char const *src) {
+            size_t ret = 0u;
+            while (*src++ != '\0') {
+                ret++;
+            }
+            return ret;
+        }
+
+        void lockHeap() {
+            heapLock.lockWriting();
+        }
+
+        void unlockHeap() {
+            heapLock.unlockWriting();
+        }
+
+        void resetHeapLock() {
+            heapLock = SpinIncrementLock16();
+        }
+
+        BlockHeader *headerOf(void *const what) {
+            return reinterpret_cast<BlockHeader *>(reinterpret_cast<size_t>(what) - blockHeaderSize);
+        }
+
+        size_t usableSize(void *const what) {
+            auto const header = headerOf(what);
+            return header->length - header->lead;
+        }
+
+        void setErrno(int const err) {
+            if (__errno_location != nullptr) {
+                *__errno_location() = err;
+            }
+        }
+
+        bool ensureInit() {
+            if (Bitmaps::allocator != nullptr) {
+                return true;
+            }
+            auto reserve = reserveSize;
+            while (!Bitmaps::initReserved(reserve)) {
+                reserve /= 2u;
+                if (reserve < minReserveSize) {
+                    return false;
+                }
+            }
+            if (__register_atfork != nullptr) {
+                __register_atfork(lockHeap, unlockHeap, resetHeapLock, nullptr);
+            }
+            return true;
+        }
+
+        // nullptr when the heap cannot be set up or the request cannot fit in what is left of the reservation.
+        void *allocateAligned(size_t const alignment, size_t const size) {
+            if (alignment >= reserveSize) {
+                return nullptr;
+            }
+            auto const extra = blockHeaderSize + (alignment > defaultAlignmentBytes ? alignment : 0u);
+            if (size > reserveSize - extra) {
+                return nullptr;
+            }
+            auto const length = alignToBits(size + extra, alignmentBits);
+            lockHeap();
+            auto const block = ensureInit() ? reinterpret_cast<size_t>(Bitmaps::allocator->allocate(length)) : 0u;
+            unlockHeap();
+            if (block == 0u) {
+                return nullptr;
+            }
+            auto const what = alignment > defaultAlignmentBytes ?
+                              roundUpNearestMultiple(block + blockHeaderSize, alignment) : block + blockHeaderSize;
+            auto const header = headerOf(reinterpret_cast<void *>(what));
+            header->length = length;
+            header->lead = what - block;
+            return reinterpret_cast<void *>(what);
+        }
+
+        void deAllocate(void *const what) {
+            auto const header = headerOf(what);
+            auto const block = reinterpret_cast<void *>(reinterpret_cast<size_t>(what) - header->lead);
+            auto const length = header->length;
+            lockHeap();
+            Bitmaps::allocator->deAllocate(block, length);
+            unlockHeap();
+        }
+    }
+
+    void debug(char const *const str) {
+        if (Debug::enabled) {
+            constexpr size_t sysWrite = syscallBase + 1;
+            constexpr size_t stderr = 2;
+            const size_t len = strlen(str);
+            __asm__ __volatile__("syscall;" : : "a"(sysWrite), "D"(stderr), "S"(str), "d"(len) : "rcx", "r11", "memory");
+        }
+    }
+}
+
+using namespace Gx;
+
+#define LOALLOC_EXPORT extern "C" __attribute__((visibility("default")))
+
+LOALLOC_EXPORT void *malloc(size_t const size) {
+    auto const ret = allocateAligned(defaultAlignmentBytes, size);
+    if (ret == nullptr) {
+        setErrno(errNoMem);
+    }
+    return ret;
+}
+
+LOALLOC_EXPORT void free(void *const what) {
+    if (what != nullptr) {
+        deAllocate(what);
+    }
+}
+
+LOALLOC_EXPORT void *calloc(size_t const num, size_t const size) {
+    size_t total;
+    if (__builtin_mul_overflow(num, size, &total)) {
+        setErrno(errNoMem);
+        return nullptr;
+    }
+    auto const ret = malloc(total);
+    if (ret != nullptr) {
+        auto const words = reinterpret_cast<size_t *>(ret);
+        for (size_t i = 0u; i < usableSize(ret) / sizeof(size_t); ++i) {
+            words[i] = 0u;
+        }
+    }
+    return ret;
+}
+
+LOALLOC_EXPORT void *realloc(void *const what, size_t const size) {
+    if (what == nullptr) {
+        return malloc(size);
+    }
+    if (size == 0u) {
+        free(what);
+        return nullptr;
+    }
+    auto const oldSize = usableSize(what);
+    if (size <= oldSize) {
+        return what;
+    }
+    auto const ret = malloc(size);
+    if (ret != nullptr) {
+        auto const dst = reinterpret_cast<uint8_t *>(ret);
+        auto const src = reinterpret_cast<uint8_t const *>(what);
+        for (size_t i = 0u; i < oldSize; ++i) {
+            dst[i] = src[i];
+        }
+        free(what);
+    }
+    return ret;
+}
+
+LOALLOC_EXPORT int posix_memalign(void **const result, size_t const alignment, size_t const size) {
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1u)) != 0u) {
+        return errInval;
+    }
+    auto const ret = allocateAligned(alignment, size);
+    if (ret == nullptr) {
+        return errNoMem;
+    }
+    *result = ret;
+    return 0;
+}
+
+LOALLOC_EXPORT void *aligned_alloc(size_t const alignment, size_t const size) {
+    void *ret = nullptr;
+    auto const err = posix_memalign(&ret, alignment < sizeof(void *) ? sizeof(void *) : alignment, size);
+    if (err != 0) {
+        setErrno(err);
+    }
+    return ret;
+}
+
+LOALLOC_EXPORT void *memalign(size_t const alignment, size_t const size) {
+    return aligned_alloc(alignment, size);
+}
+
+LOALLOC_EXPORT void *valloc(size_t const size) {
+    return aligned_alloc(minPageFrameSize, size);
+}
+
+LOALLOC_EXPORT void *pvalloc(size_t const size) {
+    return aligned_alloc(minPageFrameSize, roundUpNearestMultiple(size, minPageFrameSize));
+}
+
+LOALLOC_EXPORT size_t malloc_usable_size(void *const what) {
+    return what == nullptr ? 0u : usableSize(what);
+}
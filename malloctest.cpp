@@ -0,0 +1,84 @@
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <malloc.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace {
+    constexpr size_t gib = size_t(1u) << 30u;
+
+    void checkDisjoint(uint8_t const *const a, uint8_t const *const b, size_t const len) {
+        if (a + len > b && b + len > a) { __builtin_trap(); }
+    }
+
+    // Runs in a fresh process under a 1 GiB address space limit, far below the default reservation.
+    int limited() {
+        auto const small = static_cast<uint8_t *>(malloc(64u));
+        if (small == nullptr) { __builtin_trap(); }
+        small[63] = 0x5au;
+        size_t volatile const tooBig = 2u * gib;
+        errno = 0;
+        if (malloc(tooBig) != nullptr || errno != ENOMEM) { __builtin_trap(); }
+        free(small);
+        return 0;
+    }
+
+    // Re-executes this binary under the limit so the heap is set up afresh.
+    void checkLimited(char const *const self) {
+        auto const pid = fork();
+        if (pid < 0) { __builtin_trap(); }
+        if (pid == 0) {
+            rlimit const limit = { gib, gib };
+            if (setrlimit(RLIMIT_AS, &limit) != 0) { _exit(2); }
+            execl("/proc/self/exe", self, "limited", static_cast<char *>(nullptr));
+            _exit(2);
+        }
+        int status = 0;
+        if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) { __builtin_trap(); }
+    }
+}
+
+int main(int const argc, char const *const *const argv) {
+    if (argc > 1) {
+        return limited();
+    }
+    // Lengths above 4 GiB used to be truncated to 32 bits on the way into the heap.
+    size_t volatile const big = 5u * gib;
+    auto const a = static_cast<uint8_t *>(malloc(big));
+    auto const b = static_cast<uint8_t *>(malloc(big));
+    if (a == nullptr || b == nullptr) { __builtin_trap(); }
+    if (malloc_usable_size(a) < big || malloc_usable_size(b) < big) { __builtin_trap(); }
+    checkDisjoint(a, b, big);
+    a[0] = a[big - 1u] = 0xa5u;
+    b[0] = b[big - 1u] = 0x5au;
+    if (a[0] != 0xa5u || a[big - 1u] != 0xa5u || b[0] != 0x5au || b[big - 1u] != 0x5au) { __builtin_trap(); }
+    free(b);
+    free(a);
+
+    // Anything the reservation cannot hold fails with ENOMEM rather than trapping.
+    void *aligned = nullptr;
+    if (posix_memalign(&aligned, size_t(1u) << 40u, 8u) != ENOMEM || aligned != nullptr) { __builtin_trap(); }
+    errno = 0;
+    if (malloc(size_t(1u) << 40u) != nullptr || errno != ENOMEM) { __builtin_trap(); }
+    size_t volatile const huge = SIZE_MAX;
+    errno = 0;
+    if (malloc(huge) != nullptr || errno != ENOMEM) { __builtin_trap(); }
+    size_t volatile const most = 40u * gib;
+    auto const first = malloc(most);
+    if (first == nullptr) { __builtin_trap(); }
+    errno = 0;
+    if (malloc(most) != nullptr || errno != ENOMEM) { __builtin_trap(); }
+    free(first);
+
+    auto const after = static_cast<uint8_t *>(malloc(64u));
+    if (after == nullptr) { __builtin_trap(); }
+    free(after);
+
+    // The reservation shrinks to fit a small address space instead of trapping.
+    checkLimited(argv[0]);
+    puts("malloctest ok");
+    return 0;
+}
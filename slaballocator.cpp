@@ -1,40 +1,320 @@
 #include "regionallocator"
+#include "syscall"
 
 namespace Gx {
     void BitmapObject::offset(size_t const offset) {
-        if(Bitmaps::allocator->first() == this && offset !=0u) {
+        if(owner()->first() == this && offset !=0u) {
             __builtin_trap();
         }
         header.firstOffset = offset;
     }
 
-    void *initBrk();
-
-    size_t extendBrk(void *const alloc, size_t const len);
-
     Bitmaps *Bitmaps::allocator = nullptr;
+    size_t Bitmaps::verifySampleInterval = 0u;
+    size_t Bitmaps::verifyFullInterval = 0u;
+    size_t Bitmaps::verifySampleCountdown = 0u;
+    size_t Bitmaps::verifyFullCountdown = 0u;
 
-    void Bitmaps::init() {
-        allocator = reinterpret_cast<Bitmaps *>(initBrk());
+    namespace {
         constexpr size_t initialUsed = alignToBits(sizeof(Bitmaps) + sizeof(BitmapObject), alignmentBits);
         constexpr size_t initialAlloc = roundUpNearestMultiple(initialUsed, minPageFrameSize);
+    }
+
+    void Bitmaps::init() {
+        allocator = reinterpret_cast<Bitmaps *>(initBrk());
         if (extendBrk(allocator, initialAlloc) != initialAlloc) { __builtin_trap(); }
+        allocator->backing = Backing::Brk;
+        allocator->placementMode = Placement::FirstFit;
+        allocator->backingFd = UINT32_MAX;
+        allocator->backingLimit = 0u;
         allocator->initMaps(initialUsed, initialAlloc - initialUsed);
         allocator->dump();
     }
 
-    void Bitmaps::extend(size_t const size) {
-        auto extensionSize = roundUpNearestMultiple(size, minPageFrameSize);
-        if (allocLength + extensionSize == allocLength) { __builtin_trap(); }
-        allocLength += extensionSize;
-        if (extendBrk(allocator, allocLength) != allocLength) { __builtin_trap(); }
+    bool Bitmaps::initReserved(size_t const reserve) {
+        auto const limit = roundUpNearestMultiple(max(reserve, initialAlloc), minPageFrameSize);
+        auto const base = mmap(nullptr, limit, protRead | protWrite, flagsPrivate | flagsAnon | flagsNoReserve, UINT32_MAX);
+        if (syscallFailed(reinterpret_cast<size_t>(base))) {
+            return false;
+        }
+        allocator = reinterpret_cast<Bitmaps *>(base);
+        allocator->backing = Backing::Reserved;
+        allocator->placementMode = Placement::FirstFit;
+        allocator->backingFd = UINT32_MAX;
+        allocator->backingLimit = limit;
+        if (allocator->resize(initialAlloc) != initialAlloc) { __builtin_trap(); }
+        allocator->initMaps(initialUsed, initialAlloc - initialUsed);
+        return true;
+    }
+
+    Bitmaps *Bitmaps::openPersistent(char const *const path, size_t const reserve) {
+        auto const fd = Gx::open(path);
+        if (syscallFailed(fd)) {
+            return nullptr;
+        }
+        auto const limit = roundUpNearestMultiple(max(reserve, initialAlloc), minPageFrameSize);
+        auto const length = fileLength(fd);
+        if (syscallFailed(length) || length > limit || (length != 0u && length < initialAlloc)) {
+            Gx::close(fd);
+            return nullptr;
+        }
+        auto const base = mmap(nullptr, limit, protRead | protWrite, flagsShared, fd);
+        if (syscallFailed(reinterpret_cast<size_t>(base))) {
+            Gx::close(fd);
+            return nullptr;
+        }
+        auto const heap = reinterpret_cast<Bitmaps *>(base);
+        if ((length == 0u && syscallFailed(ftruncate(fd, initialAlloc))) ||
+            (length != 0u && (heap->allocLength != length || !heap->consistent()))) {
+            Debug::start() + "Rejecting persistent heap " + path + Debug::end;
+            mummap(base, limit);
+            Gx::close(fd);
+            return nullptr;
+        }
+        heap->backing = Backing::File;
+        heap->placementMode = Placement::FirstFit;
+        heap->backingFd = fd;
+        heap->backingLimit = limit;
+        if (length == 0u) {
+            heap->initMaps(initialUsed, initialAlloc - initialUsed);
+        }
+        return heap;
+    }
+
+    void Bitmaps::sync() {
+        if (backing != Backing::File) {
+            return;
+        }
+        if (syscallFailed(msync(this, allocLength))) { __builtin_trap(); }
+    }
+
+    void Bitmaps::closePersistent() {
+        if (backing != Backing::File) {
+            return;
+        }
+        sync();
+        auto const fd = backingFd;
+        mummap(this, backingLimit);
+        Gx::close(fd);
+    }
+
+    size_t Bitmaps::resize(size_t const len) {
+        if (backing == Backing::File) {
+            if (len > backingLimit || syscallFailed(ftruncate(backingFd, len))) {
+                return 0u;
+            }
+            return len;
+        }
+        if (backing == Backing::Reserved) {
+            if (len > backingLimit) {
+                return 0u;
+            }
+            if (len < allocLength) {
+                madviseDontNeed(fromOffset<void>(len), allocLength - len);
+            }
+            return len;
+        }
+        return extendBrk(this, len);
+    }
+
+    bool Bitmaps::consistent() const {
+        if (magic != HEAP_MAGIC || version != HEAP_VERSION ||
+            headerSize != sizeof(Bitmaps) || objectSize != sizeof(BitmapObject)) {
+            return false;
+        }
+        if (allocLength < initialAlloc || totalAlloc > allocLength) {
+            return false;
+        }
+        // Links are followed relative to this header, nothing in the file is trusted until checked.
+        auto const isChunk = [this](size_t const offset) {
+            return offset >= sizeof(Bitmaps) && offset + sizeof(BitmapObject) <= allocLength &&
+                   (offset == sizeof(Bitmaps) || alignToBits(offset, alignmentBits) == offset);
+        };
+        // Anything else the header points at was handed out by allocate(), so lies past the first chunk.
+        auto const isAllocation = [this](size_t const offset) {
+            return offset >= initialUsed && offset < allocLength && alignToBits(offset, alignmentBits) == offset;
+        };
+        if ((spare != 0u && !(isAllocation(spare) && isChunk(spare))) ||
+            (toDelete != 0u && !(isAllocation(toDelete) && isChunk(toDelete))) ||
+            (rootObject != 0u && !isAllocation(rootObject))) {
+            return false;
+        }
+        size_t sum = 0u;
+        size_t allocated = 0u;
+        size_t numChunks = 0u;
+        bool prevAllocation = false;
+        for (auto bitmapOffset = toOffset(first()); ; ) {
+            auto const *const bitmap = fromOffset<BitmapObject>(bitmapOffset);
+            if (bitmap->header.self != bitmapOffset || bitmap->offset() != sum || bitmap->count() > sizeof(bitmap->v)) {
+                return false;
+            }
+            for (size_t pos = 0u; pos < bitmap->count(); ) {
+                auto const len = bitmap->encodedLen(pos);
+                if (len == 0u) {
+                    return false;
+                }
+                auto const dec = bitmap->decode(pos);
+                if (dec.val.val == 0u || dec.val.allocated == prevAllocation) {
+                    return false;
+                }
+                sum += dec.val.val << alignmentBits;
+                if (sum > allocLength) {
+                    return false;
+                }
+                if (dec.val.allocated) {
+                    allocated += dec.val.val << alignmentBits;
+                }
+                prevAllocation = dec.val.allocated;
+                pos += len;
+            }
+            if (++numChunks > allocLength / sizeof(BitmapObject) ||
+                !isChunk(bitmap->header.next) || !isChunk(bitmap->header.prev)) {
+                return false;
+            }
+            auto const nextOffset = bitmap->header.next;
+            if (fromOffset<BitmapObject>(nextOffset)->header.prev != bitmapOffset) {
+                return false;
+            }
+            if (nextOffset == toOffset(first())) {
+                break;
+            }
+            bitmapOffset = nextOffset;
+        }
+        return sum == allocLength && allocated == totalAlloc;
+    }
+
+    void Bitmaps::verify(size_t const sampleInterval, size_t const fullInterval) {
+        verifySampleInterval = verifySampleCountdown = sampleInterval;
+        verifyFullInterval = verifyFullCountdown = fullInterval;
+    }
+
+    Bitmaps::WindowSums Bitmaps::sumWindow(BitmapObject *const from, size_t const hi, size_t const offset,
+                                           size_t const size, bool const allocated) {
+        WindowSums sums;
+        sums.allocated = sums.free = sums.touched = 0u;
+        sums.inconsistent = false;
+        auto const end = min(hi, allocLength);
+        auto const opEnd = min(offset + size, end);
+        bool havePrev = false;
+        bool prevAllocation = false;
+        size_t sum = from->offset();
+        for (auto *bitmap = from; sum < end; ) {
+            if (bitmap->offset() != sum) {
+                sums.inconsistent = true;
+                Debug::start() + "XXXXXXXXXXX OFFSET Summed 0x" + sum + " Offset is 0x" + bitmap->offset() + Debug::end;
+            }
+            for (size_t pos = 0u; pos < bitmap->count() && sum < end; ) {
+                auto const dec = bitmap->decode(pos);
+                auto const runLen = dec.val.val << alignmentBits;
+                if (dec.val.val == 0u || (havePrev && dec.val.allocated == prevAllocation)) {
+                    sums.inconsistent = true;
+                    Debug::start() + "XXXXXXXXXXX RUN at 0x" + sum + " len 0x" + runLen + Debug::end;
+                }
+                auto const inWindow = min(sum + runLen, end) - sum;
+                (dec.val.allocated ? sums.allocated : sums.free) += inWindow;
+                if (dec.val.allocated == allocated && offset < sum + inWindow && opEnd > sum) {
+                    sums.touched += min(sum + inWindow, opEnd) - max(sum, offset);
+                }
+                havePrev = true;
+                prevAllocation = dec.val.allocated;
+                sum += runLen;
+                pos += dec.len;
+            }
+            bitmap = bitmap->next();
+            if (bitmap == first()) {
+                break;
+            }
+        }
+        if (sum < end) {
+            sums.inconsistent = true;
+            Debug::start() + "XXXXXXXXXXX WINDOW ends 0x" + sum + " expected 0x" + end + Debug::end;
+        }
+        return sums;
+    }
+
+    Bitmaps::VerifyWindow::ChunkSums Bitmaps::chunkSums(VerifyWindow &window, BitmapObject const *const chunk) {
+        for (auto const &cached : window.cache) {
+            if (cached.chunk == chunk && cached.offset == chunk->offset() && cached.count == chunk->count()) {
+                return cached;
+            }
+        }
+        auto &sums = window.cache[window.nextCache++ % VerifyWindow::cacheSize];
+        sums.chunk = chunk;
+        sums.offset = chunk->offset();
+        sums.count = chunk->count();
+        sums.allocated = sums.free = 0u;
+        for (size_t pos = 0u; pos < chunk->count(); ) {
+            auto const dec = chunk->decode(pos);
+            (dec.val.allocated ? sums.allocated : sums.free) += dec.val.val << alignmentBits;
+            pos += dec.len;
+        }
+        return sums;
+    }
+
+    // The chunk before centre is never removed by the operation, so the window restarts from it
+    // afterwards. The window ends on a chunk boundary at least past the chunk after centre and reach
+    // beyond centre's start.
+    void Bitmaps::openWindow(VerifyWindow &window, BitmapObject *const centre, size_t const reach) {
+        window.from = centre == first() ? centre : centre->prev();
+        window.lo = window.from->offset();
+        window.allocated = window.free = 0u;
+        window.totalAlloc = totalAlloc;
+        window.allocLength = allocLength;
+        auto const reachEnd = centre->offset() + reach;
+        bool coveredNext = false;
+        for (auto *chunk = window.from; ; ) {
+            auto const sums = chunkSums(window, chunk);
+            window.allocated += sums.allocated;
+            window.free += sums.free;
+            coveredNext = coveredNext || chunk == centre->next();
+            chunk = chunk->next();
+            window.hi = chunk == first() ? allocLength : chunk->offset();
+            if (chunk == first() || (coveredNext && window.hi >= reachEnd)) {
+                break;
+            }
+        }
+    }
+
+    void Bitmaps::checkWindow(VerifyWindow const &window, size_t const offset, size_t const size, bool const allocated) {
+        auto const sums = sumWindow(window.from, window.hi, offset, size, allocated);
+        auto const trimmed = window.allocLength - allocLength;
+        auto const lost = window.allocated + window.free - sums.allocated - sums.free;
+        auto const expected = offset < allocLength ? min(offset + size, allocLength) - offset : 0u;
+        bool inconsistent = sums.inconsistent || allocLength > window.allocLength ||
+                            trimmed % minPageFrameSize != 0u || lost > trimmed || sums.touched != expected;
+        if (allocated) {
+            inconsistent = inconsistent || trimmed != 0u || totalAlloc != window.totalAlloc + size ||
+                           sums.allocated != window.allocated + size || sums.free + size != window.free;
+        } else {
+            inconsistent = inconsistent || totalAlloc + size != window.totalAlloc ||
+                           sums.allocated + size != window.allocated || sums.free + lost != window.free + size;
+        }
+        if (inconsistent) {
+            Debug::start() + "XXXXXXXXXXX WINDOW 0x" + window.lo + "-0x" + window.hi + " op 0x" + offset + " len 0x" + size +
+            (allocated ? " A" : " F") + " allocated 0x" + window.allocated + "->0x" + sums.allocated + " free 0x" +
+            window.free + "->0x" + sums.free + " used " + window.totalAlloc + "->" + totalAlloc + " of " +
+            window.allocLength + "->" + allocLength + Debug::end;
+            dump(true);
+            __builtin_trap();
+        }
+    }
+
+    // False when the backing cannot grow, the heap is left as it was.
+    bool Bitmaps::extend(size_t const size) {
+        auto const extensionSize = roundUpNearestMultiple(size, minPageFrameSize);
+        auto const newLength = allocLength + extensionSize;
+        if (extensionSize < size || newLength <= allocLength || resize(newLength) != newLength) {
+            return false;
+        }
+        allocLength = newLength;
         first()->prev()->append(extensionSize, false);
+        return true;
     }
 
     void Bitmaps::contract(size_t const size) {
         auto contractionSize = roundDownNearestMultiple(size, minPageFrameSize);
+        if (resize(allocLength - contractionSize) != allocLength - contractionSize) { __builtin_trap(); }
         allocLength -= contractionSize;
-        if (extendBrk(allocator, allocLength) != allocLength) { __builtin_trap(); }
         if (size < contractionSize) { __builtin_trap(); }
         if (size != contractionSize) {
             first()->prev()->append(size - contractionSize, false);
@@ -42,14 +322,19 @@ namespace Gx {
     }
 
     void Bitmaps::initMaps(size_t const used, size_t const free) {
+        magic = HEAP_MAGIC;
+        version = HEAP_VERSION;
+        headerSize = sizeof(Bitmaps);
+        objectSize = sizeof(BitmapObject);
         auto first = reinterpret_cast<BitmapObject*>(reinterpret_cast<size_t>(this) + sizeof(Bitmaps));
+        first->header.self = sizeof(Bitmaps);
         first->prev(first);
         first->next(first);
         first->prev()->append(used, true);
         first->prev()->append(free, false);
         totalAlloc += used;
         allocLength += used + free;
-        spare = reinterpret_cast<BitmapObject*>(allocate(sizeof(BitmapObject), false));
+        spare = toOffset(allocate(sizeof(BitmapObject), false));
     }
 
     void BitmapObject::append(size_t const sizeofSize, bool const allocated) {
@@ -125,9 +410,9 @@ namespace Gx {
         constexpr size_t mergeThreshold = sizeof(v) / 2 -  REBALANCE_THRESHOLD;
         if (count() + REBALANCE_THRESHOLD > sizeof(v)) {
             if((prev()->count() >= mergeThreshold && next()->count() >= mergeThreshold)
-                || prev() == Bitmaps::allocator->first() ||
-                   next() == Bitmaps::allocator->first()) {
-                auto spare = Bitmaps::allocator->getSpare();
+                || prev() == owner()->first() ||
+                   next() == owner()->first()) {
+                auto spare = owner()->getSpare();
                 spare->next(next());
                 spare->prev(this);
                 spare->next()->prev(spare);
@@ -148,7 +433,7 @@ namespace Gx {
                 count(split);
                 spare->offset(currOffset);
                 spare->count(sparePos - split);
-            } else if(this != Bitmaps::allocator->first() && prev()->count() < mergeThreshold) {
+            } else if(this != owner()->first() && prev()->count() < mergeThreshold) {
                 size_t diffOffset = 0u;
                 DecodedBitmapVal val;
                 while((val.pos + val.len) < count() / 2) {
@@ -166,7 +451,7 @@ namespace Gx {
                 count(count() - numToCopy);
                 prev()->count(prev()->count() + numToCopy);
                 offset(offset() + diffOffset);
-            } else if(next() != Bitmaps::allocator->first() && next()->count() < mergeThreshold) {
+            } else if(next() != owner()->first() && next()->count() < mergeThreshold) {
                 size_t diffOffset = 0u;
                 DecodedBitmapVal val;
                 val = reverseDecode(count() / 2);
@@ -186,7 +471,7 @@ namespace Gx {
                 next()->count(next()->count() + numToCopy);
                 next()->offset(next()->offset() - diffOffset);
             }
-        } else if (this != Bitmaps::allocator->first() && count() < REBALANCE_THRESHOLD) {
+        } else if (this != owner()->first() && count() < REBALANCE_THRESHOLD) {
             if(prev()->count() + count() + REBALANCE_THRESHOLD < sizeof(v)) {
                 auto numToCopy = count();
                 auto startPos = prev()->count();
@@ -196,8 +481,8 @@ namespace Gx {
                 prev()->count(prev()->count() + numToCopy);
                 prev()->next(next());
                 next()->prev(prev());
-                Bitmaps::allocator->toDelete = this;
-            }  else if(next() != Bitmaps::allocator->first() && next()->count() + count() + REBALANCE_THRESHOLD < sizeof(v)) {
+                owner()->toDelete = owner()->toOffset(this);
+            }  else if(next() != owner()->first() && next()->count() + count() + REBALANCE_THRESHOLD < sizeof(v)) {
                 auto numToCopy = count();
                 next()->v.shift(numToCopy, 0, next()->count());
                 for(auto i = 0u; i < numToCopy; ++i) {
@@ -207,7 +492,7 @@ namespace Gx {
                 next()->count(next()->count() + numToCopy);
                 prev()->next(next());
                 next()->prev(prev());
-                Bitmaps::allocator->toDelete = this;
+                owner()->toDelete = owner()->toOffset(this);
             }
         }
     }
@@ -239,12 +524,12 @@ namespace Gx {
 
 
         bool borrowedPrev = false;
-        if(con.currVal.pos == 0 && this != Bitmaps::allocator->first() ) {
+        if(con.currVal.pos == 0 && this != owner()->first() ) {
             borrowedPrev = true;
             con.prevVal = prev()->reverseDecode(prev()->count());
         }
         bool borrowedNext = false;
-        if(con.currVal.pos + con.currVal.len == count() && this != Bitmaps::allocator->last()) {
+        if(con.currVal.pos + con.currVal.len == count() && this != owner()->last()) {
             borrowedNext = true;
             con.nextVal = next()->decode(0u);
         } else {
@@ -324,6 +609,115 @@ namespace Gx {
         return ret;
     }
 
+    BitmapObject::BitmapVal BitmapObject::findBySizeFromTop(size_t const sizeofSize) {
+        const size_t size = alignToBits(sizeofSize, alignmentBits) >> alignmentBits;
+        BitmapVal ret;
+        Context con;
+        ret.allocated = false;
+        ret.val = 0u;
+        size_t runEnd = this == owner()->last() ? owner()->allocLength : next()->offset();
+        for (auto pos = count(); ; pos = con.currVal.pos) {
+            if (pos == 0u) {
+                return ret;
+            }
+            con.currVal = reverseDecode(pos);
+            if (!con.currVal.val.allocated && con.currVal.val.val >= size) {
+                break;
+            }
+            runEnd -= con.currVal.val.val << alignmentBits;
+        }
+
+        if (count() + REBALANCE_THRESHOLD > sizeof(v)) {
+            ret.val = 1u;
+            return ret;
+        }
+
+        bool borrowedPrev = false;
+        if(con.currVal.pos == 0 && this != owner()->first() ) {
+            borrowedPrev = true;
+            con.prevVal = prev()->reverseDecode(prev()->count());
+        } else {
+            con.prevVal = reverseDecode(con.currVal.pos);
+        }
+        bool borrowedNext = false;
+        if(con.currVal.pos + con.currVal.len == count() && this != owner()->last()) {
+            borrowedNext = true;
+            con.nextVal = next()->decode(0u);
+        } else {
+            con.nextVal = decode(con.currVal.pos + con.currVal.len);
+        }
+
+        if (con.currVal.val.allocated || !con.prevVal.val.allocated ||
+            (con.nextVal.len != 0u && !con.nextVal.val.allocated)) {
+            __builtin_trap();
+        }
+
+        if (con.currVal.val.val > size) {
+            // split, the allocation joins the run above
+            BitmapVal remainingVal;
+            remainingVal.allocated = false;
+            remainingVal.val = con.currVal.val.val - size;
+            BitmapVal newVal;
+            newVal.allocated = true;
+            newVal.val = size + con.nextVal.val.val;
+            ssize_t shiftLen = v.getLen(remainingVal.val) + v.getLen(newVal.val) - con.currVal.len;
+            if(!borrowedNext) {
+                shiftLen -= con.nextVal.len;
+            }
+
+            v.shift(shiftLen, con.currVal.pos, count());
+            size_t encLen = encode(remainingVal, con.currVal.pos);
+            encLen += encode(newVal, con.currVal.pos + encLen);
+            ssize_t countDiff = encLen - con.currVal.len;
+
+            if(borrowedNext) {
+                next()->v.shift(-con.nextVal.len, 0, next()->count());
+                next()->count(next()->count() - con.nextVal.len);
+                next()->offset(next()->offset() + (con.nextVal.val.val << alignmentBits));
+            } else {
+                countDiff -= con.nextVal.len;
+            }
+            count(count() + countDiff);
+
+        } else {
+            // merge with prev and next
+            BitmapVal mergedVal;
+            mergedVal.allocated = true;
+            mergedVal.val = con.prevVal.val.val + con.currVal.val.val + con.nextVal.val.val;
+            ssize_t shiftLen = v.getLen(mergedVal.val) - con.currVal.len;
+            auto prevInsertPos = con.currVal.pos;
+            if(!borrowedPrev) {
+                shiftLen -= con.prevVal.len;
+                prevInsertPos -= con.prevVal.len;
+            }
+            if(!borrowedNext) {
+                shiftLen -= con.nextVal.len;
+            }
+
+            v.shift(shiftLen, prevInsertPos, count());
+            size_t encLen = encode(mergedVal, prevInsertPos);
+            ssize_t countDiff = encLen - con.currVal.len;
+
+            if(borrowedPrev) {
+                prev()->count(prev()->count() - con.prevVal.len);
+                offset(offset() - (con.prevVal.val.val << alignmentBits));
+            } else {
+                countDiff -= con.prevVal.len;
+            }
+            if(borrowedNext) {
+                next()->v.shift(-con.nextVal.len, 0, next()->count());
+                next()->count(next()->count() - con.nextVal.len);
+                next()->offset(next()->offset() + (con.nextVal.val.val << alignmentBits));
+            } else {
+                countDiff -= con.nextVal.len;
+            }
+            count(count() + countDiff);
+        }
+        ret.val = runEnd - (size << alignmentBits);
+        ret.allocated = true;
+        return ret;
+    }
+
     BitmapObject::FindType BitmapObject::findByOffset(size_t const globalOffset, size_t const sizeofSize) {
         if (globalOffset < offset()) {
             return NotFound;
@@ -342,17 +736,17 @@ namespace Gx {
         }
 
         if(relativeOffset >= cumulativeOffset) {
-            Bitmaps::allocator->dump();
+            owner()->dump();
             return NeverGoingToBeFound;
         }
 
         bool borrowedPrev = false;
-        if(con.currVal.pos == 0 && this != Bitmaps::allocator->first() ) {
+        if(con.currVal.pos == 0 && this != owner()->first() ) {
             borrowedPrev = true;
             con.prevVal = prev()->reverseDecode(prev()->count());
         }
         bool borrowedNext = false;
-        if(con.currVal.pos + con.currVal.len == count() && this != Bitmaps::allocator->last()) {
+        if(con.currVal.pos + con.currVal.len == count() && this != owner()->last()) {
             borrowedNext = true;
             con.nextVal = next()->decode(0u);
         } else {
@@ -2,6 +2,7 @@
 #include "atomics"
 #include "syscall"
 #include "regionallocator"
+#include "handle"
 
 /*
 extern "C"
@@ -15,18 +16,6 @@ void *memset(void *ptr, Gx::int32_t len, Gx::size_t val) {
 }
 */
 namespace Gx {
-    template<size_t size>
-    struct syscallBaseType;
-    template<>
-    struct syscallBaseType<4> {
-        constexpr static size_t value = 0x40000000u;
-    };
-    template<>
-    struct syscallBaseType<8> {
-        constexpr static size_t value = 0x0u;
-    };
-    constexpr size_t syscallBase = syscallBaseType<sizeof(size_t)>::value;
-
     size_t strlen(char const *src) {
         auto ret = 0;
         while (*src++ != '\0') {
@@ -105,23 +94,6 @@ namespace Gx {
         return ret.as64;
     }
 
-    void *initBrk() {
-        constexpr size_t sysBrk = syscallBase + 12;
-        void *newBrk = nullptr;
-        __asm__ __volatile__("syscall;" : "=a"(newBrk): "a"(sysBrk), "D"(0u) :  "rcx", "r11");
-        return newBrk;
-    }
-
-    size_t extendBrk(void *const alloc, size_t const len) {
-        constexpr size_t sysBrk = syscallBase + 12;
-        uintptr_t allocVal = reinterpret_cast<uintptr_t>(alloc);
-        uintptr_t requestedEnd = allocVal + len;
-        if (allocVal + len != requestedEnd) { __builtin_trap(); }
-        uintptr_t newEnd = 0u;
-        __asm__ __volatile__("syscall" : "=a"(newEnd) : "a"(sysBrk), "D"(requestedEnd) : "rcx", "r11");
-        return newEnd - allocVal;
-    }
-
     void debug(char const *const str) {
         if (Debug::enabled) {
             constexpr unsigned sysWrite = syscallBase + 1;
@@ -177,10 +149,296 @@ uint32_t xorshift128(uint32_t &x, uint32_t &y, uint32_t &z, uint32_t &w) {
     return w;
 }
 
+// Resident set of the whole process, the second field of /proc/self/statm counted in pages.
+size_t residentBytes() {
+    char buf[128];
+    auto const fd = openReadOnly("/proc/self/statm");
+    if(syscallFailed(fd)) { __builtin_trap(); }
+    auto const len = Gx::read(fd, buf, sizeof(buf));
+    Gx::close(fd);
+    if(syscallFailed(len)) { __builtin_trap(); }
+    size_t pos = 0u;
+    while(pos < len && buf[pos] != ' ') {
+        ++pos;
+    }
+    size_t pages = 0u;
+    for(++pos; pos < len && buf[pos] >= '0' && buf[pos] <= '9'; ++pos) {
+        pages = pages * 10u + static_cast<size_t>(buf[pos] - '0');
+    }
+    return pages * minPageFrameSize;
+}
+
+// Writes every byte so the allocation counts towards RSS.
+void* touch(void* const what, size_t const howMuch) {
+    auto const bytes = reinterpret_cast<uint8_t*>(what);
+    for(auto i = 0u; i < howMuch; ++i) {
+        bytes[i] = static_cast<uint8_t>(i);
+    }
+    return what;
+}
+
+// Replays the same mixed lifetime trace for a placement mode: bursts of transient objects with the odd
+// survivor mixed in. Reports the peak heap length and process RSS, and their averages once each burst
+// is freed.
+void lifetimeBench(Bitmaps::Placement const placement) {
+    constexpr size_t rounds = 64u;
+    constexpr size_t burst = 4096u;
+    constexpr size_t survivorEvery = 64u;
+    constexpr size_t maxSurvivors = rounds * burst / survivorEvery;
+    struct Allocs {
+        void* what;
+        size_t howMuch;
+    };
+    uint32_t x = 5;
+    uint32_t y = 6;
+    uint32_t z = 7;
+    uint32_t w = 8;
+    Bitmaps::allocator->placement(placement);
+    auto transient = reinterpret_cast<Allocs*>(Bitmaps::allocator->allocate(burst * sizeof(Allocs), Bitmaps::Lifetime::Long));
+    auto survivors = reinterpret_cast<Allocs*>(Bitmaps::allocator->allocate(maxSurvivors * sizeof(Allocs), Bitmaps::Lifetime::Long));
+    size_t numSurvivors = 0u;
+    size_t peak = 0u;
+    size_t settled = 0u;
+    size_t peakRss = 0u;
+    size_t settledRss = 0u;
+    for(auto round = 0u; round < rounds; ++round) {
+        for(auto i = 0u; i < burst; ++i) {
+            transient[i].howMuch = (xorshift128(x, y, z, w) & 0x3f0u) + 16u;
+            transient[i].what = touch(Bitmaps::allocator->allocate(transient[i].howMuch, Bitmaps::Lifetime::Short),
+                                      transient[i].howMuch);
+            if((i % survivorEvery) == 0u) {
+                survivors[numSurvivors].howMuch = (xorshift128(x, y, z, w) & 0x3f0u) + 16u;
+                survivors[numSurvivors].what = touch(Bitmaps::allocator->allocate(survivors[numSurvivors].howMuch,
+                                                                                  Bitmaps::Lifetime::Long),
+                                                     survivors[numSurvivors].howMuch);
+                ++numSurvivors;
+            }
+        }
+        peak = max(peak, Bitmaps::allocator->heapSize());
+        peakRss = max(peakRss, residentBytes());
+        for(auto i = 0u; i < burst; ++i) {
+            Bitmaps::allocator->deAllocate(transient[i].what, transient[i].howMuch);
+        }
+        settled += Bitmaps::allocator->heapSize();
+        settledRss += residentBytes();
+    }
+    Debug::start() + (placement == Bitmaps::Placement::Segregated ? "segregated" : "first fit") + " peak 0x" + peak +
+    " settled 0x" + settled / rounds + " live 0x" + Bitmaps::allocator->inUse() + " rss peak 0x" + peakRss +
+    " settled 0x" + settledRss / rounds + Debug::end;
+    for(auto i = 0u; i < numSurvivors; ++i) {
+        Bitmaps::allocator->deAllocate(survivors[i].what, survivors[i].howMuch);
+    }
+    Bitmaps::allocator->deAllocate(survivors, maxSurvivors * sizeof(Allocs));
+    Bitmaps::allocator->deAllocate(transient, burst * sizeof(Allocs));
+    Bitmaps::allocator->placement(Bitmaps::Placement::FirstFit);
+}
+
+// Flips bytes of a heap file behind the allocator's back.
+void patchHeapFile(char const* const path, size_t const from, size_t const to, uint8_t const mask) {
+    auto const fd = Gx::open(path);
+    auto const length = fileLength(fd);
+    auto const base = reinterpret_cast<uint8_t*>(mmap(nullptr, length, protRead | protWrite, flagsShared, fd));
+    if(syscallFailed(reinterpret_cast<size_t>(base)) || to > length) { __builtin_trap(); }
+    for(auto i = from; i < to; ++i) {
+        base[i] ^= mask;
+    }
+    mummap(base, length);
+    Gx::close(fd);
+}
+
+// Builds a file heap next to the process heap and reopens it with the old range still occupied, so the
+// offsets have to carry it to a new address. Then checks a wrong version and mangled varints are rejected
+// rather than trusted.
+void persistentTest() {
+    constexpr char const* path = "/tmp/loalloc-test.heap";
+    constexpr size_t reserve = 256u * 1024u * 1024u;
+    constexpr size_t rootLen = 16u;
+    constexpr size_t numAllocs = 20000u;
+    // Pointers don't survive a remap, so allocations are kept as offsets from the heap.
+    struct Allocs {
+        size_t offset;
+        size_t howMuch;
+    };
+    struct Root {
+        uint64_t pattern[rootLen];
+        Handle<uint64_t> marker;
+        Allocs churn[numAllocs];
+    };
+    uint32_t x = 9;
+    uint32_t y = 10;
+    uint32_t z = 11;
+    uint32_t w = 12;
+    auto const churn = [&](Bitmaps* const heap, Root* const root) {
+        auto const base = reinterpret_cast<size_t>(heap);
+        for(auto i = 0u; i < numAllocs; ++i) {
+            if(root->churn[i].offset != 0u && (xorshift128(x, y, z, w) & 0x1u) != 0u) {
+                heap->deAllocate(reinterpret_cast<void*>(base + root->churn[i].offset), root->churn[i].howMuch);
+                root->churn[i].offset = 0u;
+            }
+        }
+        for(auto i = 0u; i < numAllocs; ++i) {
+            if(root->churn[i].offset == 0u) {
+                root->churn[i].howMuch = (xorshift128(x, y, z, w) & 0x3f0u) + 16u;
+                root->churn[i].offset = reinterpret_cast<size_t>(heap->allocate(root->churn[i].howMuch)) - base;
+            }
+        }
+        if(!heap->consistent()) { __builtin_trap(); }
+    };
+
+    unlink(path);
+    auto heap = Bitmaps::openPersistent(path, reserve);
+    if(heap == nullptr || heap == Bitmaps::allocator) { __builtin_trap(); }
+    auto processAlloc = operator new(64u);
+    auto root = reinterpret_cast<Root*>(heap->allocate(sizeof(Root)));
+    for(auto i = 0u; i < rootLen; ++i) {
+        root->pattern[i] = i * 0x9e3779b97f4a7c15ull;
+    }
+    for(auto i = 0u; i < numAllocs; ++i) {
+        root->churn[i].offset = 0u;
+    }
+    root->marker = Handle<uint64_t>::allocate(*heap);
+    *root->marker.get(*heap) = 0x600dcafeull;
+    heap->root(root);
+    churn(heap, root);
+    operator delete(processAlloc, 64u);
+    auto const oldBase = heap;
+    heap->closePersistent();
+
+    auto const placeholder = mmap(oldBase, reserve);
+    if(placeholder != oldBase) { __builtin_trap(); }
+    heap = Bitmaps::openPersistent(path, reserve);
+    if(heap == nullptr || heap == oldBase || !heap->consistent()) { __builtin_trap(); }
+    root = reinterpret_cast<Root*>(heap->root());
+    for(auto i = 0u; i < rootLen; ++i) {
+        if(root->pattern[i] != i * 0x9e3779b97f4a7c15ull) { __builtin_trap(); }
+    }
+    if(*root->marker.get(*heap) != 0x600dcafeull) { __builtin_trap(); }
+    root->marker.free(*heap);
+    churn(heap, root);
+    heap->closePersistent();
+    mummap(placeholder, reserve);
+
+    // A fresh heap keeps its runs in the first chunk, churn may have moved them all out.
+    unlink(path);
+    heap = Bitmaps::openPersistent(path, reserve);
+    if(heap == nullptr || heap->allocate(64u) == nullptr) { __builtin_trap(); }
+    heap->closePersistent();
+    constexpr size_t versionPos = sizeof(uint64_t);
+    patchHeapFile(path, versionPos, versionPos + 1u, 0x01u);
+    if(Bitmaps::openPersistent(path, reserve) != nullptr) { __builtin_trap(); }
+    patchHeapFile(path, versionPos, versionPos + 1u, 0x01u);
+    heap = Bitmaps::openPersistent(path, reserve);
+    if(heap == nullptr) { __builtin_trap(); }
+    heap->closePersistent();
+
+    constexpr size_t firstRuns = sizeof(Bitmaps) + BitmapObject::runsOffset();
+    patchHeapFile(path, firstRuns, sizeof(Bitmaps) + sizeof(BitmapObject), 0xffu);
+    if(Bitmaps::openPersistent(path, reserve) != nullptr) { __builtin_trap(); }
+    unlink(path);
+    Debug::start() + "persistent heap ok" + Debug::end;
+}
+
+// Gives a fresh heap in a child a free tail one unit short of allocLength and allocates from it. The
+// allocation itself doesn't notice, so the child only dies if the sampled check is on and catches it.
+uint32_t corruptedHeapStatus(size_t const sampleInterval) {
+    constexpr size_t reserve = 16u * 1024u * 1024u;
+    constexpr uint32_t setupFailed = 2u;
+    auto const pid = fork();
+    if(syscallFailed(pid)) { __builtin_trap(); }
+    if(pid != 0u) {
+        return waitStatus(pid);
+    }
+    Bitmaps::verify(sampleInterval, 0u);
+    if(!Bitmaps::initReserved(reserve)) {
+        exit(setupFailed);
+    }
+    auto const chunk = reinterpret_cast<BitmapObject*>(reinterpret_cast<size_t>(Bitmaps::allocator) + sizeof(Bitmaps));
+    auto const tail = chunk->reverseDecode(chunk->count());
+    auto const lowByte = reinterpret_cast<uint8_t*>(chunk) + BitmapObject::runsOffset() + tail.pos;
+    if(tail.len == 0u || tail.val.allocated || (*lowByte & 0x3fu) == 0u) {
+        exit(setupFailed);
+    }
+    --*lowByte;
+    Bitmaps::allocator->allocate(64u);
+    exit(0u);
+    return setupFailed;
+}
+
+void verifierTest() {
+    constexpr uint32_t sigIll = 4u;
+    if(corruptedHeapStatus(0u) != 0u) { __builtin_trap(); }
+    if((corruptedHeapStatus(1u) & 0x7fu) != sigIll) { __builtin_trap(); }
+    Debug::start() + "verifier caught corruption" + Debug::end;
+}
+
+// Unbalanced binary tree of 100000 random keys linked by 32 bit handles, torn down again.
+void handleTreeTest() {
+    struct Node {
+        Handle<Node> left;
+        Handle<Node> right;
+        uint32_t key;
+    };
+    constexpr size_t numNodes = 100000u;
+    constexpr size_t maxDepth = 256u;
+    Handle<Node> none;
+    if(none.get() != nullptr) { __builtin_trap(); }
+    none.free();
+    auto const before = Bitmaps::allocator->inUse();
+    uint32_t x = 13;
+    uint32_t y = 14;
+    uint32_t z = 15;
+    uint32_t w = 16;
+    auto root = Handle<Node>::allocate();
+    root->left = root->right = Handle<Node>();
+    root->key = 500000u;
+    for(auto i = 0u; i < numNodes; ++i) {
+        auto const key = xorshift128(x, y, z, w) % 1000000u;
+        for(auto node = root; ; ) {
+            auto& child = key < node->key ? node->left : node->right;
+            if(!child) {
+                child = Handle<Node>::allocate();
+                child->left = child->right = Handle<Node>();
+                child->key = key;
+                break;
+            }
+            node = child;
+        }
+    }
+    auto const used = Bitmaps::allocator->inUse() - before;
+    Debug::start() + "handle tree node " + sizeof(Node) + " used 0x" + used + Debug::end;
+    // Raw handles, an array of Handle<Node> would be zeroed through memset.
+    uint32_t stack[maxDepth];
+    size_t depth = 0u;
+    size_t freed = 0u;
+    stack[depth++] = root.raw();
+    while(depth != 0u) {
+        Handle<Node> node(stack[--depth]);
+        if(depth + 2u > maxDepth) { __builtin_trap(); }
+        if(node->left) {
+            if(node->left->key >= node->key) { __builtin_trap(); }
+            stack[depth++] = node->left.raw();
+        }
+        if(node->right) {
+            if(node->right->key < node->key) { __builtin_trap(); }
+            stack[depth++] = node->right.raw();
+        }
+        node.free();
+        ++freed;
+    }
+    if(freed != numNodes + 1u) { __builtin_trap(); }
+}
+
 extern "C"
 void _start() {
     Bitmaps::init();
     Bitmaps::allocator->dump(true);
+    Bitmaps::verify(1u, 100000u);
+    lifetimeBench(Bitmaps::Placement::FirstFit);
+    lifetimeBench(Bitmaps::Placement::Segregated);
+    persistentTest();
+    handleTreeTest();
+    verifierTest();
+    Bitmaps::allocator->dump();
     uint32_t x = 1;
     uint32_t y = 2;
     uint32_t z = 3;
@@ -214,7 +472,6 @@ void _start() {
                 test[i].what = nullptr;
             }
         }
-        if((i % 100000) == 0) {  Bitmaps::allocator->dump(true); }
     }
     for(auto stress = 0; stress < 16; ++stress) {
         for (auto i = 0u; i < max; ++i) {
@@ -224,7 +481,6 @@ void _start() {
                     test[i].what = nullptr;
                 }
             }
-            if((i % 100000) == 0) {  Bitmaps::allocator->dump(true); }
         }
 
         for (auto i = 0u; i < max; ++i) {
@@ -234,7 +490,6 @@ void _start() {
                     test[i].what = operator new(test[i].howMuch);
                 }
             }
-            if((i % 100000) == 0) {  Bitmaps::allocator->dump(true); }
         }
         Debug::start() + stress + Debug::end;
     }
@@ -243,7 +498,6 @@ void _start() {
         if(test[i].what != nullptr) {
             Bitmaps::allocator->deAllocate(test[i].what, test[i].howMuch);
             test[i].what = nullptr;
-            Bitmaps::allocator->dump(false);
         }
     }
     Bitmaps::allocator->deAllocate(test, max * sizeof(Allocs));